@@ -5,21 +5,46 @@
 #include <linux/cdev.h>
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/crc32.h>
+#include <linux/completion.h>
 
 #include "rp1-kernel-test.h"
 
 static int ringbuffer_size = 1024 * 1024 * 16;
 module_param(ringbuffer_size, int, 0444);
 
-// not sure how to go from example_open back to the platform_device and example_state
-static struct example_state *gs;
-static dev_t characterDevice;
+// default busy-poll budget for each open of the rx device, can be changed per-file with EXAMPLE_IOC_SET_BUSY_POLL
+static unsigned int busy_poll_usecs = 0;
+module_param(busy_poll_usecs, uint, 0644);
+
+// ceiling for EXAMPLE_IOC_SET_BUSY_POLL, so an unprivileged open cant make every read spin for minutes
+static unsigned int busy_poll_max_usecs = 1000;
+module_param(busy_poll_max_usecs, uint, 0644);
+
+// how many tx buffers can be queued on the dma before write() blocks, and how big each one is
+static int tx_queue_depth = 4;
+module_param(tx_queue_depth, int, 0444);
+static int tx_buffer_size = 1024 * 1024;
+module_param(tx_buffer_size, int, 0444);
+
+// software stand-in for the tx dma, writes are checksummed and completed in place instead of going to the pio fifo
+// lets the write path be exercised without a pio program draining the fifo, the byte count and crc32 are logged on release
+// the tx dma channel is still needed, the buffers are allocated against it
+static bool tx_soft_dma = false;
+module_param(tx_soft_dma, bool, 0444);
+
+#define TX_TIMEOUT msecs_to_jiffies(10000)
+
 static struct class *pio_class;
 
 static int example_open(struct inode *inode, struct file *file);
 static ssize_t example_write(struct file *file, const char *data, size_t len,  loff_t *offset);
 static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *offset);
 static int example_release(struct inode *inode, struct file *file);
+static long example_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int example_flush(struct file *file, fl_owner_t id);
 
 static const struct of_device_id example_ids[] = {
   { .compatible = "rp1,example", },
@@ -32,6 +57,8 @@ static struct file_operations char_fops_rx = {
   .owner = THIS_MODULE,
   .open = example_open,
   .read = example_read,
+  .unlocked_ioctl = example_ioctl,
+  .compat_ioctl = compat_ptr_ioctl,
   .release = example_release,
 };
 
@@ -39,6 +66,7 @@ static struct file_operations char_fops_tx = {
   .owner = THIS_MODULE,
   .open = example_open,
   .write = example_write,
+  .flush = example_flush,
   .release = example_release,
 };
 
@@ -47,7 +75,7 @@ static void dma_cycle_complete(void *ptr, const struct dmaengine_result *result)
   //struct dma_tx_state dma_state;
   struct example_state *state = ptr;
 
-  printk(KERN_INFO"dma complete3 %d %d\n", result->result, result->residue);
+  dev_dbg(state->dev, "dma complete3 %d %d\n", result->result, result->residue);
 
   //dmastat = dmaengine_tx_status(state->rx_chan, state->rx_ring_cookie, &dma_state);
   // the dma_state.residue is how many bytes remain to be copied for the current cycle
@@ -57,14 +85,6 @@ static void dma_cycle_complete(void *ptr, const struct dmaengine_result *result)
 
   state->chunk_received = true;
   wake_up(&state->wait_queue);
-
-#if 0
-  if (ptr) {
-    struct dma_packet_in_progress *ps = ptr;
-    ps->dma_done = true;
-    wake_up(&ps->wait_queue);
-  }
-#endif
 }
 
 static int start_dma_rx_ring(struct example_state *state, int len) {
@@ -94,26 +114,103 @@ static int start_dma_rx_ring(struct example_state *state, int len) {
   return 0;
 }
 
+static void tx_free_slots(struct example_state *state) {
+  struct device * dev = state->tx_chan->device->dev;
+
+  for (int i=0; i<tx_queue_depth; i++) {
+    if (state->tx_slots[i].buffer) dma_free_noncoherent(dev, tx_buffer_size, state->tx_slots[i].buffer, state->tx_slots[i].dma, DMA_TO_DEVICE);
+  }
+  kfree(state->tx_slots);
+  state->tx_slots = NULL;
+}
+
+static int tx_alloc_slots(struct example_state *state) {
+  struct device * dev = state->tx_chan->device->dev;
+
+  state->tx_slots = kcalloc(tx_queue_depth, sizeof(struct example_tx_slot), GFP_KERNEL);
+  if (!state->tx_slots) return -ENOMEM;
+
+  for (int i=0; i<tx_queue_depth; i++) {
+    struct example_tx_slot *slot = &state->tx_slots[i];
+    slot->state = state;
+    slot->buffer = dma_alloc_noncoherent(dev, tx_buffer_size, &slot->dma, DMA_TO_DEVICE, GFP_KERNEL);
+    if (!slot->buffer) {
+      tx_free_slots(state);
+      return -ENOMEM;
+    }
+    init_completion(&slot->done);
+    complete(&slot->done);
+  }
+  state->tx_head = 0;
+  state->tx_error = 0;
+  return 0;
+}
+
 static int example_open(struct inode *inode, struct file *file) {
-  file->private_data = gs;
+  // each probe embeds its own cdev, so the inode leads back to the right device
+  struct example_state *state = container_of(inode->i_cdev, struct example_state, chardev);
+  file->private_data = state;
 
   // TODO, grab a lock
-  if (gs->open_handle) return -EBUSY;
-  gs->open_handle = file;
-  gs->read_ptr = 0;
+  if (state->open_handle) return -EBUSY;
+  state->open_handle = file;
+  state->tx_bytes = 0;
+  state->tx_crc = ~0;
+
+  // the tx device has no rx ring to start
+  if (state->rx_chan) {
+    state->read_ptr = 0;
+    state->busy_poll_usecs = busy_poll_usecs;
+    memset(&state->stats, 0, sizeof(state->stats));
 
-  init_waitqueue_head(&gs->wait_queue);
-  start_dma_rx_ring(gs, ringbuffer_size);
+    init_waitqueue_head(&state->wait_queue);
+    start_dma_rx_ring(state, ringbuffer_size);
+  }
+  if (state->tx_chan) {
+    int ret = tx_alloc_slots(state);
+    if (ret) {
+      state->open_handle = NULL;
+      return ret;
+    }
+  }
   return 0;
 }
 
 static void dma_complete2(void *ptr, const struct dmaengine_result *result) {
+  struct example_tx_slot *slot = ptr;
   //printk(KERN_INFO"dma complete2 %d %d\n", result->result, result->residue);
-  if (ptr) {
-    struct dma_packet_in_progress *ps = ptr;
-    ps->dma_done = true;
-    wake_up(&ps->wait_queue);
+
+  if ((result->result != DMA_TRANS_NOERROR) || result->residue) WRITE_ONCE(slot->state->tx_error, -EIO);
+  complete(&slot->done);
+}
+
+static void soft_dma_tx(struct example_state *state, struct example_tx_slot *slot, size_t len) {
+  struct dmaengine_result result = { .result = DMA_TRANS_NOERROR, .residue = 0 };
+
+  state->tx_crc = crc32_le(state->tx_crc, slot->buffer, len);
+  state->tx_bytes += len;
+
+  dma_complete2(slot, &result);
+}
+
+// wait until every queued descriptor has finished, on timeout the channel is stopped so nothing can still touch the buffers
+static int tx_drain(struct example_state *state) {
+  bool stuck = false;
+
+  for (int i=0; i<tx_queue_depth; i++) {
+    struct completion *done = &state->tx_slots[i].done;
+    if (stuck) {
+      try_wait_for_completion(done);
+    } else if (!wait_for_completion_timeout(done, TX_TIMEOUT)) {
+      dev_err(state->dev, "tx dma timed out\n");
+      dmaengine_terminate_sync(state->tx_chan);
+      WRITE_ONCE(state->tx_error, -ETIMEDOUT);
+      stuck = true;
+    }
+    // hand the token back, the slot is free again
+    complete(done);
   }
+  return xchg(&state->tx_error, 0);
 }
 
 static ssize_t example_write_direct(struct file *file, const char *data, size_t len,  loff_t *offset) {
@@ -135,54 +232,109 @@ done:
   return ret;
 }
 
+// queues the data on the dma and returns, only blocks while all tx_queue_depth slots are in flight
 static ssize_t example_write_dma(struct file *file, const char *data, size_t len,  loff_t *offset) {
   struct example_state *state = file->private_data;
-  int ret = len;
-  struct dma_async_tx_descriptor *desc;
-  dma_addr_t dma;
   struct device * dev = state->tx_chan->device->dev;
-  char *buffer = dma_alloc_noncoherent(dev, len, &dma, DMA_TO_DEVICE, GFP_KERNEL);
-
-  printk(KERN_INFO"write %llx %ld %llx %llx\n", (uint64_t)buffer, len, dma, (uint64_t)dev);
-  if (!buffer) return -ENOMEM;
-
-  if (copy_from_user(buffer, data, len) != 0) {
-    ret = -EFAULT;
-    goto done;
-  }
+  struct dma_async_tx_descriptor *desc;
+  size_t done = 0;
+  int ret = 0;
 
-  //dma_addr_t iommu_dma_addr = dma_map_single(state->chan->device->dev, buffer, len, DMA_TO_DEVICE);
+  while (done < len) {
+    struct example_tx_slot *slot = &state->tx_slots[state->tx_head];
+    size_t chunk = min_t(size_t, len - done, tx_buffer_size);
 
-  dma_sync_single_for_device(dev, dma, len, DMA_TO_DEVICE);
+    long waited = wait_for_completion_interruptible_timeout(&slot->done, TX_TIMEOUT);
+    if (waited <= 0) {
+      ret = waited ? waited : -ETIMEDOUT;
+      break;
+    }
+    // an earlier descriptor failed, dont pretend later data made it out
+    // if part of this write already went out the error stays pending for the next call
+    ret = READ_ONCE(state->tx_error);
+    if (ret) {
+      complete(&slot->done);
+      if (!done) xchg(&state->tx_error, 0);
+      break;
+    }
 
-  desc = dmaengine_prep_slave_single(state->tx_chan, dma, len, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
-  desc->callback_result = dma_complete2;
-  desc->callback_param = NULL;
+    if (copy_from_user(slot->buffer, data + done, chunk) != 0) {
+      complete(&slot->done);
+      ret = -EFAULT;
+      break;
+    }
 
-  printk(KERN_INFO"phys: %llx\n", (uint64_t)desc->phys);
-  printk(KERN_INFO"chan: %llx\n", (uint64_t)desc->chan);
-  printk(KERN_INFO"tx_submit: %llx\n", (uint64_t)desc->tx_submit);
-  //printk(KERN_INFO": %x\n", desc->);
-  int cookie = dmaengine_submit(desc);
-  int retr = dma_submit_error(cookie);
-  printk(KERN_INFO"ret %d, cookie %d\n", retr, cookie);
+    if (tx_soft_dma) {
+      soft_dma_tx(state, slot, chunk);
+    } else {
+      dma_sync_single_for_device(dev, slot->dma, chunk, DMA_TO_DEVICE);
+
+      desc = dmaengine_prep_slave_single(state->tx_chan, slot->dma, chunk, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+      if (!desc) {
+        dev_err(state->dev, "Preparing DMA tx failed\n");
+        complete(&slot->done);
+        ret = -ENOMEM;
+        break;
+      }
+      desc->callback_result = dma_complete2;
+      desc->callback_param = slot;
+
+      int cookie = dmaengine_submit(desc);
+      int retr = dma_submit_error(cookie);
+      dev_dbg(state->dev, "write slot:%d len:%ld ret %d, cookie %d\n", state->tx_head, chunk, retr, cookie);
+      if (retr) {
+        complete(&slot->done);
+        ret = retr;
+        break;
+      }
+
+      dma_async_issue_pending(state->tx_chan);
+    }
 
-  dma_async_issue_pending(state->tx_chan);
-  printk(KERN_INFO"issued, nap time\n");
+    state->tx_head = (state->tx_head + 1) % tx_queue_depth;
+    done += chunk;
+  }
 
-  msleep(10000);
-  printk(KERN_INFO"nap done\n");
-done:
-  //dma_free_coherent(dev, len, buffer, dma);
-  dma_free_noncoherent(dev, len, buffer, dma, DMA_TO_DEVICE);
+  // a partial write is still a write, userland retries the rest and sees the error then
+  if (done) return done;
   return ret;
 }
 
 static ssize_t example_write(struct file *file, const char *data, size_t len,  loff_t *offset) {
-  if (len < 2) return example_write_direct(file, data, len, offset);
+  // with the soft dma every byte has to be checksummed, so skip the direct register path
+  if ((len < 2) && !tx_soft_dma) return example_write_direct(file, data, len, offset);
   else return example_write_dma(file, data, len, offset);
 }
 
+static uint64_t rx_write_ptr(struct example_state *state) {
+  struct dma_tx_state dma_state;
+
+  dmaengine_tx_status(state->rx_chan, state->rx_ring_cookie, &dma_state);
+  return (ringbuffer_size - dma_state.residue) % ringbuffer_size;
+}
+
+// spin on the dma residue until the write-ptr moves past read_ptr, or the budget runs out
+// similar to SO_BUSY_POLL, this trades cpu time for not having to wait for the next period irq
+static bool rx_busy_poll(struct example_state *state) {
+  ktime_t deadline = ktime_add_us(ktime_get(), state->busy_poll_usecs);
+
+  do {
+    if (rx_write_ptr(state) != state->read_ptr) return true;
+    if (signal_pending(current) || need_resched()) break;
+    cpu_relax();
+  } while (ktime_before(ktime_get(), deadline));
+
+  return rx_write_ptr(state) != state->read_ptr;
+}
+
+static void rx_record_latency(struct example_state *state, ktime_t start) {
+  uint64_t usecs = ktime_us_delta(ktime_get(), start);
+  unsigned int bucket = usecs ? ilog2(usecs) + 1 : 0;
+
+  if (bucket >= EXAMPLE_LAT_BUCKETS) bucket = EXAMPLE_LAT_BUCKETS - 1;
+  state->stats.latency_hist[bucket]++;
+}
+
 static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *offset) {
   //printk(KERN_INFO"example_read(%p, %p, %ld, offset)\n", file, data, len);
   struct example_state *state = file->private_data;
@@ -190,20 +342,31 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
   struct device * dev = state->rx_chan->device->dev;
   enum dma_status dmastat;
   struct dma_tx_state dma_state;
+  ktime_t start = ktime_get();
+  bool polled = false;
+
+  if (state->busy_poll_usecs) {
+    polled = rx_busy_poll(state);
+    if (polled) state->stats.busy_poll_hits++;
+    else state->stats.busy_poll_misses++;
+  }
 
-  // block until dma complete
-  wait_event(state->wait_queue, state->chunk_received);
+  if (!polled) {
+    // block until dma complete
+    wait_event(state->wait_queue, state->chunk_received);
+    state->stats.irq_wakeups++;
+  }
 
   dmastat = dmaengine_tx_status(state->rx_chan, state->rx_ring_cookie, &dma_state);
   // the dma_state.residue is how many bytes remain to be copied for the current cycle
   // because dmaengine_prep_dma_cyclic was set with len/2, this callback gets ran twice, when the write-pointer is at the start and middle of the buffer
   // due to latencies in the irq, the write-ptr is already to 1022kb past the expected point
-  printk(KERN_INFO"last:%d used:%d residue:%d in_flight_bytes:%d, mycookie:%d\n", dma_state.last, dma_state.used, dma_state.residue, dma_state.in_flight_bytes, state->rx_ring_cookie);
+  dev_dbg(state->dev, "last:%d used:%d residue:%d in_flight_bytes:%d, mycookie:%d\n", dma_state.last, dma_state.used, dma_state.residue, dma_state.in_flight_bytes, state->rx_ring_cookie);
 
   uint64_t write_ptr = ringbuffer_size - dma_state.residue;
 
-  printk(KERN_INFO"read buf:%llx len:%ld data:0x%llx\n", (uint64_t)state->buffer, len, (uint64_t)data);
-  printk(KERN_INFO"writeptr: %lld, readptr: %lld\n", write_ptr, state->read_ptr);
+  dev_dbg(state->dev, "read buf:%llx len:%ld data:0x%llx\n", (uint64_t)state->buffer, len, (uint64_t)data);
+  dev_dbg(state->dev, "writeptr: %lld, readptr: %lld\n", write_ptr, state->read_ptr);
 
   unsigned int available;
   if (state->read_ptr <= write_ptr) {
@@ -211,7 +374,7 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
   } else if (state->read_ptr > write_ptr) {
     available = (write_ptr + ringbuffer_size) - state->read_ptr;
   }
-  printk(KERN_INFO"available: %d\n", available);
+  dev_dbg(state->dev, "available: %d\n", available);
 
   if (len > available) len = available;
 
@@ -219,7 +382,7 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
 
   // TODO, when the write pointer wraps, this doesnt respect the length userland asked for, causing buffer overflow
   if (state->read_ptr <= write_ptr) {
-    printk(KERN_INFO"simplecase %d\n", tocopy);
+    dev_dbg(state->dev, "simplecase %d\n", tocopy);
     dma_sync_single_for_device(dev, state->dma + state->read_ptr, tocopy, DMA_FROM_DEVICE);
     if (copy_to_user(data, state->buffer + state->read_ptr, tocopy) != 0) {
       ret = -EFAULT;
@@ -228,10 +391,10 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
     state->read_ptr += tocopy;
     ret = tocopy;
   } else if (state->read_ptr > write_ptr) {
-    printk(KERN_INFO"complex 1\n");
+    dev_dbg(state->dev, "complex 1\n");
     unsigned int len1 = ringbuffer_size - state->read_ptr;
     dma_sync_single_for_device(dev, state->dma + state->read_ptr, len1, DMA_FROM_DEVICE);
-    printk(KERN_INFO"copy_to_user(0x%llx, 0x%llx, %ld)\n", (uint64_t)(data), (uint64_t)(state->buffer + state->read_ptr), len);
+    dev_dbg(state->dev, "copy_to_user(0x%llx, 0x%llx, %ld)\n", (uint64_t)(data), (uint64_t)(state->buffer + state->read_ptr), len);
     if (copy_to_user(data, state->buffer + state->read_ptr, len) != 0) {
       ret = -EFAULT;
       goto done;
@@ -240,9 +403,9 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
     state->read_ptr = state->read_ptr % ringbuffer_size;
 
     unsigned int len2 = write_ptr;
-    printk(KERN_INFO"complex 2 len1:%d len2:%d\n", len1, len2);
+    dev_dbg(state->dev, "complex 2 len1:%d len2:%d\n", len1, len2);
     dma_sync_single_for_device(dev, state->dma + state->read_ptr, len2, DMA_FROM_DEVICE);
-    printk(KERN_INFO"copy_to_user(0x%llx, 0x%llx, %d)\n", (uint64_t)(data + len1), (uint64_t)state->buffer, len2);
+    dev_dbg(state->dev, "copy_to_user(0x%llx, 0x%llx, %d)\n", (uint64_t)(data + len1), (uint64_t)state->buffer, len2);
     if (copy_to_user(data + len1, state->buffer, len2) != 0) {
       ret = -EFAULT;
       goto done;
@@ -254,25 +417,83 @@ static ssize_t example_read(struct file *file, char *data, size_t len,  loff_t *
   state->chunk_received = false;
 
 done:
-  printk(KERN_INFO"readptr: %lld\n", state->read_ptr);
-  printk(KERN_INFO"ret %d\n", ret);
+  rx_record_latency(state, start);
+  dev_dbg(state->dev, "readptr: %lld\n", state->read_ptr);
+  dev_dbg(state->dev, "ret %d\n", ret);
   return ret;
 }
 
+static long example_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+  struct example_state *state = file->private_data;
+  void __user *argp = (void __user *)arg;
+  __u32 usecs;
+
+  switch (cmd) {
+  case EXAMPLE_IOC_SET_BUSY_POLL:
+    if (get_user(usecs, (__u32 __user *)argp)) return -EFAULT;
+    if (usecs > busy_poll_max_usecs) return -EINVAL;
+    state->busy_poll_usecs = usecs;
+    return 0;
+  case EXAMPLE_IOC_GET_BUSY_POLL:
+    return put_user(state->busy_poll_usecs, (__u32 __user *)argp);
+  case EXAMPLE_IOC_GET_STATS:
+    if (copy_to_user(argp, &state->stats, sizeof(state->stats)) != 0) return -EFAULT;
+    return 0;
+  case EXAMPLE_IOC_RESET_STATS:
+    memset(&state->stats, 0, sizeof(state->stats));
+    return 0;
+  }
+  return -ENOTTY;
+}
+
+// called on close(), so userland finds out if the tail of its data never made it out
+static int example_flush(struct file *file, fl_owner_t id) {
+  struct example_state *state = file->private_data;
+
+  if (!state->tx_slots) return 0;
+  return tx_drain(state);
+}
+
 static int example_release(struct inode *inode, struct file *file) {
   struct example_state *state = file->private_data;
-  dmaengine_terminate_sync(state->rx_chan);
-  int len = ringbuffer_size;
 
-  struct device * dev = state->rx_chan->device->dev;
+  if (state->rx_chan) {
+    dmaengine_terminate_sync(state->rx_chan);
+    int len = ringbuffer_size;
 
-  dma_free_noncoherent(dev, len, state->buffer, state->dma, DMA_FROM_DEVICE);
+    struct device * dev = state->rx_chan->device->dev;
+
+    dma_free_noncoherent(dev, len, state->buffer, state->dma, DMA_FROM_DEVICE);
+  }
+  if (state->tx_chan) {
+    if (tx_drain(state)) dev_err(state->dev, "tx data lost before close\n");
+    tx_free_slots(state);
+  }
+  if (state->tx_chan && tx_soft_dma) {
+    // compare against the crc32 printed by the userland replay
+    dev_info(state->dev, "soft dma: %llu bytes crc32 %08x\n", state->tx_bytes, ~state->tx_crc);
+  }
 
   file->private_data = NULL;
   state->open_handle = NULL;
   return 0;
 }
 
+// every probed node gets its own device number, so rx and tx can both be loaded
+static int example_add_chardev(struct example_state *state) {
+  int ret = alloc_chrdev_region(&state->devt, 0, 1, "example");
+  if (ret) {
+    dev_err(state->dev, "cant allocate device number\n");
+    return ret;
+  }
+  ret = cdev_add(&state->chardev, state->devt, 1);
+  if (ret) {
+    dev_err(state->dev, "cant add cdev\n");
+    unregister_chrdev_region(state->devt, 1);
+  }
+  return ret;
+}
+
 static int example_probe_rx(struct platform_device *pdev) {
   struct dma_slave_config rx_conf = {
     // RP1 dma driver only uses addr_width for the device end
@@ -296,14 +517,12 @@ static int example_probe_rx(struct platform_device *pdev) {
   }
   state->dev = dev;
   state->open_handle = NULL;
+  state->tx_slots = NULL;
   state->regs = devm_platform_get_and_ioremap_resource(pdev, 0, &mem);
   rx_conf.src_addr = (uint64_t)mem->start;
 
-  // TODO, check for null
-  state->chardev = cdev_alloc();
-
-  state->chardev->owner = THIS_MODULE;
-  state->chardev->ops = &char_fops_rx;
+  cdev_init(&state->chardev, &char_fops_rx);
+  state->chardev.owner = THIS_MODULE;
 
   state->tx_chan = NULL;
   state->rx_chan = dma_request_chan(dev, "rx");
@@ -315,21 +534,19 @@ static int example_probe_rx(struct platform_device *pdev) {
 
   dmaengine_slave_config(state->rx_chan, &rx_conf);
 
-  alloc_chrdev_region(&characterDevice,0,1,"example");
-  cdev_add(state->chardev, characterDevice, 1);
+  ret = example_add_chardev(state);
+  if (ret) goto fail_chan;
   dev_set_drvdata(dev, state);
-  gs = state;
 
-  if (IS_ERR(device_create(pio_class, dev, characterDevice, NULL, "example%d", 1))) {
+  if (IS_ERR(device_create(pio_class, dev, state->devt, NULL, "example%d", 1))) {
     dev_err(dev, "cant create device\n");
   }
 
   printk(KERN_INFO"example rx driver loaded\n");
   return 0;
+fail_chan:
+  dma_release_channel(state->rx_chan);
 fail:
-  cdev_del(state->chardev);
-  unregister_chrdev_region(characterDevice, 1);
-  gs = NULL;
   devm_kfree(dev, state);
   return ret;
 }
@@ -354,6 +571,7 @@ static int example_probe_tx(struct platform_device *pdev) {
     return -ENOMEM;
   }
   state->dev = dev;
+  state->open_handle = NULL;
 
   state->regs = devm_platform_get_and_ioremap_resource(pdev, 0, &mem);
 
@@ -362,11 +580,10 @@ static int example_probe_tx(struct platform_device *pdev) {
 
   writel('U', state->regs);
 
-  // TODO, check for null
-  state->chardev = cdev_alloc();
+  state->tx_slots = NULL;
 
-  state->chardev->owner = THIS_MODULE;
-  state->chardev->ops = &char_fops_tx;
+  cdev_init(&state->chardev, &char_fops_tx);
+  state->chardev.owner = THIS_MODULE;
 
   state->rx_chan = NULL;
   state->tx_chan = dma_request_chan(dev, "tx");
@@ -378,19 +595,19 @@ static int example_probe_tx(struct platform_device *pdev) {
 
   dmaengine_slave_config(state->tx_chan, &tx_conf);
 
-  alloc_chrdev_region(&characterDevice,0,1,"example");
-
-  cdev_add(state->chardev, characterDevice, 1);
-
+  ret = example_add_chardev(state);
+  if (ret) goto fail_chan;
   dev_set_drvdata(dev, state);
-  gs = state;
 
-  printk(KERN_INFO"example driver loaded\n");
+  if (IS_ERR(device_create(pio_class, dev, state->devt, NULL, "example%d", 0))) {
+    dev_err(dev, "cant create device\n");
+  }
+
+  printk(KERN_INFO"example driver loaded%s\n", tx_soft_dma ? " (soft dma)" : "");
   return 0;
+fail_chan:
+  dma_release_channel(state->tx_chan);
 fail:
-  cdev_del(state->chardev);
-  unregister_chrdev_region(characterDevice, 1);
-  gs = NULL;
   devm_kfree(dev, state);
   return ret;
 }
@@ -411,9 +628,9 @@ static int example_remove(struct platform_device *pdev) {
   struct example_state *state = dev_get_drvdata(dev);
   printk(KERN_INFO"example driver unloading\n");
 
-  device_destroy(pio_class, characterDevice);
-  cdev_del(state->chardev);
-  unregister_chrdev_region(characterDevice, 1);
+  device_destroy(pio_class, state->devt);
+  cdev_del(&state->chardev);
+  unregister_chrdev_region(state->devt, 1);
 
   if (state->tx_chan) {
     dmaengine_terminate_sync(state->tx_chan);
@@ -424,7 +641,6 @@ static int example_remove(struct platform_device *pdev) {
     dma_release_channel(state->rx_chan);
   }
 
-  gs = NULL;
   devm_kfree(dev, state);
   printk(KERN_INFO"example driver unloaded\n");
   return 0;
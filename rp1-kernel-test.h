@@ -1,7 +1,32 @@
 #pragma once
 
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// latency buckets are powers of 2 in usec, bucket 0 is <1us, the last bucket catches everything slower
+#define EXAMPLE_LAT_BUCKETS 24
+
+// time from entering example_read() until it returns to the caller
+struct example_rx_stats {
+  __u64 latency_hist[EXAMPLE_LAT_BUCKETS];
+  __u64 busy_poll_hits;   // reads satisfied while spinning on the residue
+  __u64 busy_poll_misses; // reads that spun for the whole budget and then slept
+  __u64 irq_wakeups;      // reads satisfied by dma_cycle_complete()
+};
+
+#define EXAMPLE_IOC_MAGIC 'p'
+// argument is the busy-poll budget in usec, 0 disables
+#define EXAMPLE_IOC_SET_BUSY_POLL _IOW(EXAMPLE_IOC_MAGIC, 1, __u32)
+#define EXAMPLE_IOC_GET_BUSY_POLL _IOR(EXAMPLE_IOC_MAGIC, 2, __u32)
+#define EXAMPLE_IOC_GET_STATS     _IOR(EXAMPLE_IOC_MAGIC, 3, struct example_rx_stats)
+#define EXAMPLE_IOC_RESET_STATS   _IO(EXAMPLE_IOC_MAGIC, 4)
+
+// everything above is shared with userland, the rest is driver internal
+#ifdef __KERNEL__
+
 struct example_state {
-  struct cdev *chardev;
+  struct cdev chardev;
+  dev_t devt;
   void *regs;
   struct device * dev;
   struct dma_chan *tx_chan;
@@ -14,9 +39,23 @@ struct example_state {
   wait_queue_head_t wait_queue;
   bool chunk_received;
   uint64_t read_ptr;
+  // how long example_read() may spin on the dma residue before sleeping, 0 disables busy-poll
+  unsigned int busy_poll_usecs;
+  struct example_rx_stats stats;
+  // tx queue, slots are handed to the dma in order and come back in order
+  struct example_tx_slot *tx_slots;
+  int tx_head;
+  int tx_error; // sticky error from a failed descriptor, reported by the next write or close
+  // only used with the tx_soft_dma stand-in
+  uint64_t tx_bytes;
+  u32 tx_crc;
 };
 
-struct dma_packet_in_progress {
-  wait_queue_head_t wait_queue;
-  bool dma_done;
+// one preallocated tx buffer, done holds a single token while nothing is queued on it
+struct example_tx_slot {
+  struct example_state *state;
+  char *buffer;
+  dma_addr_t dma;
+  struct completion done;
 };
+#endif
@@ -1,8 +1,10 @@
-{ stdenv, liburing }:
+{ stdenv, liburing, zlib }:
 
 stdenv.mkDerivation {
   name = "userland-example";
-  buildInputs = [ liburing ];
-  src = ./.;
+  buildInputs = [ liburing zlib ];
+  # the driver header is shared with the module, so take the whole repo and build in userland/
+  src = ../.;
+  preConfigure = "cd userland";
   dontStrip = true;
 }
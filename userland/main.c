@@ -1,11 +1,19 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <liburing.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "rp1-kernel-test.h"
 
 // based on https://git.kernel.dk/cgit/liburing/tree/examples/io_uring-cp.c
 
@@ -105,14 +113,26 @@ static int setup_child(int output, int blocksize) {
   }
 }
 
-int main(int argc, char **argv) {
-  struct io_uring ring;
+static void print_rx_stats(int pio_fd) {
+  struct example_rx_stats stats;
 
-  int ret = io_uring_queue_init(QD, &ring, 0);
-  if (ret < 0) {
-    perror("io_uring_queue_init failed\n");
-    return -1;
+  if (ioctl(pio_fd, EXAMPLE_IOC_GET_STATS, &stats) < 0) {
+    perror("EXAMPLE_IOC_GET_STATS failed");
+    return;
+  }
+
+  printf("busy-poll hits %llu misses %llu, irq wakeups %llu\n", stats.busy_poll_hits, stats.busy_poll_misses, stats.irq_wakeups);
+  // bucket 0 is <1us, bucket i is [2^(i-1), 2^i) us, the last one is open ended
+  for (int i=0; i<EXAMPLE_LAT_BUCKETS; i++) {
+    if (!stats.latency_hist[i]) continue;
+    if (i == EXAMPLE_LAT_BUCKETS - 1) printf("  >=%uus: %llu\n", 1u << (i - 1), stats.latency_hist[i]);
+    else printf("  <%uus: %llu\n", 1u << i, stats.latency_hist[i]);
   }
+}
+
+// busy_poll_usecs < 0 leaves the driver default alone and skips the latency stats
+static int capture(struct io_uring *ring, int busy_poll_usecs) {
+  int ret;
 
   int pio_fd = open("/dev/example", O_RDONLY);
   if (pio_fd < 0) {
@@ -120,6 +140,15 @@ int main(int argc, char **argv) {
     return -1;
   }
 
+  if (busy_poll_usecs >= 0) {
+    __u32 usecs = busy_poll_usecs;
+    if (ioctl(pio_fd, EXAMPLE_IOC_SET_BUSY_POLL, &usecs) < 0) {
+      perror("EXAMPLE_IOC_SET_BUSY_POLL failed");
+      return -1;
+    }
+  }
+  int blocks_done = 0;
+
   int out_file_fd = open("output.bin.gz", O_WRONLY | O_CREAT, 0644);
   if (out_file_fd < 0) {
     perror("cant open output\n");
@@ -142,10 +171,10 @@ int main(int argc, char **argv) {
   int concurrent_reads = 10;
 
   for (int i=0; i<concurrent_reads; i++) {
-    queue_read(&ring, pio_fd, blocksize);
+    queue_read(ring, pio_fd, blocksize);
   }
 
-  ret = io_uring_submit(&ring);
+  ret = io_uring_submit(ring);
   if (ret < 0) {
     perror("cant io_uring_submit\n");
     return -1;
@@ -159,7 +188,7 @@ int main(int argc, char **argv) {
 
     //printf("toread %d, towrite %d\n", toread, towrite);
 
-    ret = io_uring_wait_cqe(&ring, &cqe);
+    ret = io_uring_wait_cqe(ring, &cqe);
     //printf("0x%lx\n", (uint64_t)cqe);
     if (ret < 0) {
       perror("cant io_uring_wait_cqe\n");
@@ -170,7 +199,7 @@ int main(int argc, char **argv) {
       printf("async IO failed %d\n", cqe->res);
       printf("read? %d\n", data->read);
       return -1;
-    } else if (cqe->res != data->iov.iov_len) {
+    } else if (!data->read && (cqe->res != data->iov.iov_len)) {
       printf("error, asked for %ld, got %d\n", data->iov.iov_len, cqe->res);
       printf("read? %d\n", data->read);
       return -1;
@@ -178,10 +207,13 @@ int main(int argc, char **argv) {
 
     if (data->read) {
       pending_reads--;
-      toread -= cqe->res;
+      toread -= data->first_len;
+      // the driver returns whatever is available, busy-poll hits are nearly always short, so only write what arrived
+      towrite -= data->first_len - cqe->res;
+      data->first_len = cqe->res;
       //puts("read completed");
       clock_gettime(CLOCK_MONOTONIC, &data->read_done);
-      queue_write(&ring, out_fd, data);
+      queue_write(ring, out_fd, data);
     } else {
       pending_writes--;
       towrite -= cqe->res;
@@ -196,24 +228,309 @@ int main(int argc, char **argv) {
       write_time = write_time / 1000 / 1000 / 1000;
 
       // because $concurrent_reads of backlog exist in the uring, it takes $concurrent_reads times longer, for a read to go from being issued, to returning a result
-      double bytes_per_sec = (blocksize / totaltime) * concurrent_reads;
+      double bytes_per_sec = (data->first_len / totaltime) * concurrent_reads;
       double bits_per_sec = bytes_per_sec * 8;
       printf("WD %f %f, %f MB, %f Mbit, pending %d %d\n", readtime, write_time, bytes_per_sec/1024/1024, bits_per_sec/1000/1000, pending_reads, pending_writes);
 
       free(data);
+      blocks_done++;
+      if ((busy_poll_usecs >= 0) && ((blocks_done % concurrent_reads) == 0)) print_rx_stats(pio_fd);
 #if 1
-      queue_read(&ring, pio_fd, blocksize);
+      queue_read(ring, pio_fd, blocksize);
       toread += blocksize;
-      ret = io_uring_submit(&ring);
+      ret = io_uring_submit(ring);
       if (ret < 0) {
         perror("cant io_uring_submit\n");
         return -1;
       }
 #endif
     }
-    io_uring_cqe_seen(&ring, cqe);
+    io_uring_cqe_seen(ring, cqe);
   }
 
-  io_uring_queue_exit(&ring);
   return 0;
 }
+
+// replay: stream a file to the tx device, gzip'd input is decompressed on the fly (gzread passes plain files through)
+// a filler thread decompresses into the next free buffer and submits its write straight away, so several writes stay queued
+// the main thread only reaps completions, liburing allows one submitter and one reaper on different threads
+// order is kept by limiting io-wq to a single worker and forcing every write through it with IOSQE_ASYNC
+
+#define REPLAY_BUFS 4
+
+enum replay_buf_state { BUF_FREE, BUF_WRITING };
+
+struct replay_buf {
+  char *data;
+  size_t len;
+  off_t offset; // position in the stream, only matters when replaying into a file
+  enum replay_buf_state state;
+};
+
+struct replay_state {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct replay_buf bufs[REPLAY_BUFS];
+  size_t bufsize;
+  gzFile in;
+  struct io_uring *ring;
+  int out_fd;
+  int submitted;
+  bool stop; // set by the main thread when a write failed
+  bool eof;  // the filler has submitted everything it is going to
+  const char *error;
+};
+
+static void *replay_filler(void *ptr) {
+  struct replay_state *rs = ptr;
+  off_t pos = 0;
+  int i = 0;
+
+  while (true) {
+    struct replay_buf *buf = &rs->bufs[i];
+
+    pthread_mutex_lock(&rs->lock);
+    while ((buf->state != BUF_FREE) && !rs->stop) pthread_cond_wait(&rs->cond, &rs->lock);
+    bool stop = rs->stop;
+    pthread_mutex_unlock(&rs->lock);
+    if (stop) break;
+
+    size_t len = 0;
+    while (len < rs->bufsize) {
+      int got = gzread(rs->in, buf->data + len, rs->bufsize - len);
+      if (got <= 0) break;
+      len += got;
+    }
+    // a truncated or corrupt .gz must not look like a clean eof
+    int zerr;
+    const char *msg = gzerror(rs->in, &zerr);
+    if (zerr != Z_OK) {
+      pthread_mutex_lock(&rs->lock);
+      rs->error = msg;
+      pthread_mutex_unlock(&rs->lock);
+      break;
+    }
+    if (len == 0) break;
+
+    buf->len = len;
+    buf->offset = pos;
+    pos += len;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(rs->ring);
+    assert(sqe);
+    io_uring_prep_write(sqe, rs->out_fd, buf->data, len, buf->offset);
+    io_uring_sqe_set_data(sqe, buf);
+    io_uring_sqe_set_flags(sqe, IOSQE_ASYNC);
+
+    pthread_mutex_lock(&rs->lock);
+    buf->state = BUF_WRITING;
+    int ret = io_uring_submit(rs->ring);
+    if (ret < 0) {
+      buf->state = BUF_FREE;
+      rs->error = strerror(-ret);
+    } else {
+      rs->submitted++;
+    }
+    pthread_cond_broadcast(&rs->cond);
+    pthread_mutex_unlock(&rs->lock);
+    if (ret < 0) break;
+
+    if (len < rs->bufsize) break;
+    i = (i + 1) % REPLAY_BUFS;
+  }
+
+  pthread_mutex_lock(&rs->lock);
+  rs->eof = true;
+  pthread_cond_broadcast(&rs->cond);
+  pthread_mutex_unlock(&rs->lock);
+  return NULL;
+}
+
+// to_file replays into a regular file instead of a device, creating or truncating it
+static int replay(struct io_uring *ring, const char *input, const char *output, bool to_file) {
+  struct replay_state rs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .bufsize = 1024 * 1024,
+    .ring = ring,
+    .out_fd = -1,
+  };
+  pthread_t filler_thread;
+  bool filler_started = false;
+  int in_file_fd = -1;
+  uint64_t total = 0;
+  uLong crc = crc32(0, NULL, 0);
+  int ret = -1;
+
+  // one io-wq worker runs the writes one after another, in submission order
+  unsigned int workers[2] = { 1, 1 };
+  int err = io_uring_register_iowq_max_workers(ring, workers);
+  if (err < 0) {
+    printf("cant limit io-wq workers: %s\n", strerror(-err));
+    return -1;
+  }
+
+  in_file_fd = open(input, O_RDONLY);
+  if (in_file_fd < 0) {
+    perror("cant open input\n");
+    goto cleanup;
+  }
+  rs.in = gzdopen(in_file_fd, "rb");
+  if (!rs.in) {
+    printf("gzdopen failed\n");
+    goto cleanup;
+  }
+  // gzclose_r owns it from here
+  in_file_fd = -1;
+  gzbuffer(rs.in, rs.bufsize);
+
+  rs.out_fd = open(output, to_file ? (O_WRONLY | O_CREAT | O_TRUNC) : O_WRONLY, 0644);
+  if (rs.out_fd < 0) {
+    perror("cant open replay output\n");
+    goto cleanup;
+  }
+
+  for (int i=0; i<REPLAY_BUFS; i++) {
+    rs.bufs[i].data = malloc(rs.bufsize);
+    if (!rs.bufs[i].data) goto cleanup;
+    rs.bufs[i].state = BUF_FREE;
+  }
+
+  err = pthread_create(&filler_thread, NULL, replay_filler, &rs);
+  if (err) {
+    printf("cant start filler thread: %s\n", strerror(err));
+    goto cleanup;
+  }
+  filler_started = true;
+  ret = 0;
+
+  struct timespec start, idle_start, last_done, now;
+  double idle = 0;
+  int completed = 0;
+  int next = 0; // the single io-wq worker completes writes in this order
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last_done = start;
+
+  while (true) {
+    pthread_mutex_lock(&rs.lock);
+    if ((completed == rs.submitted) && !rs.eof) {
+      // nothing queued on the device, this is time the wire sits idle waiting on input
+      clock_gettime(CLOCK_MONOTONIC, &idle_start);
+      while ((completed == rs.submitted) && !rs.eof) pthread_cond_wait(&rs.cond, &rs.lock);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      idle += (double)timediff(&idle_start, &now) / 1000 / 1000 / 1000;
+    }
+    bool finished = (completed == rs.submitted) && rs.eof;
+    int pending = rs.submitted - completed - 1;
+    pthread_mutex_unlock(&rs.lock);
+    if (finished) break;
+
+    struct io_uring_cqe *cqe;
+    err = io_uring_wait_cqe(ring, &cqe);
+    if (err < 0) {
+      printf("cant io_uring_wait_cqe: %s\n", strerror(-err));
+      // completions can no longer be tracked, so the buffers cant be freed safely either
+      exit(-1);
+    }
+    struct replay_buf *buf = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(ring, cqe);
+    completed++;
+
+    assert(buf == &rs.bufs[next]);
+    next = (next + 1) % REPLAY_BUFS;
+
+    // later writes are already queued behind this one, so a short write cant be patched up in order
+    if ((ret == 0) && (res != (int)buf->len)) {
+      if (res < 0) printf("async write failed: %s\n", strerror(-res));
+      else printf("short write, %d of %ld\n", res, buf->len);
+      ret = -1;
+      pthread_mutex_lock(&rs.lock);
+      rs.stop = true;
+      pthread_mutex_unlock(&rs.lock);
+    }
+
+    if (ret == 0) {
+      crc = crc32(crc, (const Bytef *)buf->data, buf->len);
+      total += buf->len;
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double write_time = timediff(&last_done, &now);
+      write_time = write_time / 1000 / 1000 / 1000;
+      last_done = now;
+      double elapsed = timediff(&start, &now);
+      elapsed = elapsed / 1000 / 1000 / 1000;
+
+      double bytes_per_sec = total / elapsed;
+      double bits_per_sec = bytes_per_sec * 8;
+      // idle is the total time with no write queued at all, it should stay near 0
+      printf("TX %f %f, %f MB, %f Mbit, total %ld, pending %d\n", idle, write_time, bytes_per_sec/1024/1024, bits_per_sec/1000/1000, total, pending);
+    }
+
+    pthread_mutex_lock(&rs.lock);
+    buf->state = BUF_FREE;
+    pthread_cond_broadcast(&rs.cond);
+    pthread_mutex_unlock(&rs.lock);
+  }
+
+cleanup:
+  if (filler_started) {
+    pthread_mutex_lock(&rs.lock);
+    rs.stop = true;
+    pthread_cond_broadcast(&rs.cond);
+    pthread_mutex_unlock(&rs.lock);
+    pthread_join(filler_thread, NULL);
+  }
+  if (rs.error) {
+    printf("reading input failed: %s\n", rs.error);
+    ret = -1;
+  }
+  if (rs.in) {
+    err = gzclose_r(rs.in);
+    if ((err != Z_OK) && (ret == 0)) {
+      printf("input is corrupt or truncated (%d)\n", err);
+      ret = -1;
+    }
+  }
+  if (in_file_fd >= 0) close(in_file_fd);
+  // close() runs the driver's flush, which drains the dma queue and reports descriptors that failed after their write() returned
+  if ((rs.out_fd >= 0) && (close(rs.out_fd) < 0) && (ret == 0)) {
+    perror("tx device reported an error on close");
+    ret = -1;
+  }
+  for (int i=0; i<REPLAY_BUFS; i++) free(rs.bufs[i].data);
+
+  // with the driver loaded with tx_soft_dma=1, compare against the crc32 it logs on close
+  if (ret == 0) printf("replayed %ld bytes, crc32 %08lx\n", total, crc);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  struct io_uring ring;
+
+  int ret = io_uring_queue_init(QD, &ring, 0);
+  if (ret < 0) {
+    perror("io_uring_queue_init failed\n");
+    return -1;
+  }
+
+  if ((argc == 5) && (strcmp(argv[1], "replay") == 0) && (strcmp(argv[3], "-o") == 0)) {
+    ret = replay(&ring, argv[2], argv[4], true);
+  } else if ((argc == 3 || argc == 4) && (strcmp(argv[1], "replay") == 0)) {
+    const char *device = argc == 4 ? argv[3] : "/dev/example0";
+    ret = replay(&ring, argv[2], device, false);
+  } else if (argc == 1) {
+    ret = capture(&ring, -1);
+  } else if ((argc <= 3) && (strcmp(argv[1], "capture") == 0)) {
+    // pass 0 to get a baseline histogram with busy-poll off
+    ret = capture(&ring, argc == 3 ? atoi(argv[2]) : 0);
+  } else {
+    fprintf(stderr, "usage: %s [capture [busy_poll_usecs]]\n", argv[0]);
+    fprintf(stderr, "       %s replay <file[.gz]> [device]\n", argv[0]);
+    fprintf(stderr, "       %s replay <file[.gz]> -o <output file>\n", argv[0]);
+    ret = -1;
+  }
+
+  io_uring_queue_exit(&ring);
+  return ret;
+}